@@ -72,6 +72,8 @@
 #define TIM1_CCMR4 sfr(0x525b)
 #define TIM1_CCER1 sfr(0x525c)
 #define TIM1_CCER2 sfr(0x525d)
+#define TIM1_CNTRH sfr(0x525e)
+#define TIM1_CNTRL sfr(0x525f)
 #define TIM1_PSCRH sfr(0x5260)
 #define TIM1_PSCRL sfr(0x5261)
 #define TIM1_ARRH  sfr(0x5262)
@@ -91,17 +93,25 @@
 #define TIM2_SR1   sfr(0x5304)
 #define TIM2_EGR   sfr(0x5306)
 #define TIM2_CCMR1 sfr(0x5307)
+#define TIM2_CCMR2 sfr(0x5308)
 #define TIM2_CCMR3 sfr(0x5309)
 #define TIM2_CCER1 sfr(0x530a)
 #define TIM2_CCER2 sfr(0x530b)
 #define TIM2_PSCR  sfr(0x530e)
 #define TIM2_ARRH  sfr(0x530f)
 #define TIM2_ARRL  sfr(0x5310)
+#define TIM2_CCR1H sfr(0x5311)
+#define TIM2_CCR1L sfr(0x5312)
+#define TIM2_CCR2H sfr(0x5313)
+#define TIM2_CCR2L sfr(0x5314)
+#define TIM2_CCR3H sfr(0x5315)
+#define TIM2_CCR3L sfr(0x5316)
 
 #define TIM4_CR1  sfr(0x5340)
 #define TIM4_IER  sfr(0x5343)
 #define TIM4_SR   sfr(0x5344)
 #define TIM4_EGR  sfr(0x5345)
+#define TIM4_CNTR sfr(0x5346)
 #define TIM4_PSCR sfr(0x5347)
 #define TIM4_ARR  sfr(0x5348)
 
@@ -115,6 +125,7 @@
 
 #define NESTED_IRQ(n) (sfr(0x7f70 + (n) / 4) &= ~(3 << ((n) % 4 * 2))) // Set level 2 priority
 
+#define EXTI_PBIRQ 4
 #define EXTI_PCIRQ 5
 #define EXTI_PDIRQ 6
 #define UART_TXIRQ 17
@@ -123,12 +134,54 @@
 #define TIM4_UIRQ  23
 
 // #define DEBUG // Debug mode
+// #define TRACE // Latency tracing
+// #define GOVERNOR // Closed-loop pump governor (tach input on B4)
+// #define RELAY 1 // iBUS servo relay on TX pin (1 - pass-through, 2 - mixed values)
 
-extern uint16_t chv[14];
+#define FAILSAFE 3 // Number of lost frames (7.7ms each) before failsafe
+
+#ifndef CHMASK
+#define CHMASK 0x3ffff // Channels in use (bit N = channel N+1), set per firmware
+#endif
+
+#define CHBIT(i) ((uint32_t)(CHMASK) >> (i) & 1)
+#define CHCNT(m) (CHCNT6(m) + CHCNT6((m) >> 6) + CHCNT6((m) >> 12))
+#define CHCNT6(m) (((m) & 1) + ((m) >> 1 & 1) + ((m) >> 2 & 1) + ((m) >> 3 & 1) + ((m) >> 4 & 1) + ((m) >> 5 & 1))
+#define CHIDX(i) CHCNT((uint32_t)(CHMASK) & ((1UL << (i)) - 1))
+#define CHV(i) chv[CHIDX(i) + 0 * sizeof(char[CHBIT(i) ? 1 : -1])] // Value of channel i+1 (must be in CHMASK)
+
+extern uint16_t chv[CHCNT((uint32_t)(CHMASK))];
 
 void initserial(void);
 void initsensor(void);
+void initlight(void);
+void initoutput(uint8_t m);
+void beginoutput(void);
+void endoutput(void);
+void output(uint8_t i, uint16_t x);
+#ifdef GOVERNOR
+void initgovernor(void);
+int16_t governor(int16_t t, uint16_t v);
+void resetgovernor(void);
+void pollgovernor(void);
+uint16_t pumprpm(void);
+#endif
+#ifdef TRACE
+void trace(uint8_t i);
+void tracelost(uint8_t n);
+uint16_t tracedata(uint8_t i);
+void printtrace(void);
+#else
+#define trace(i)
+#define tracelost(n)
+#endif
+void light(uint8_t i);
 void update(void);
+void failsafe(void);
+#if RELAY == 2
+uint16_t relay(uint8_t i);
+#endif
 uint32_t sensor(uint8_t i, uint16_t v);
 uint16_t sensortype(uint8_t i);
 uint8_t sensordata(uint8_t i, uint32_t *v);
+uint8_t sensorsample(uint8_t i, uint32_t *v);
@@ -0,0 +1,111 @@
+/*
+** Copyright (C) 2022-2023 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "governor.h"
+
+#ifdef GOVERNOR
+
+#define GOV_PPR 7 // Tach pulses per revolution
+#define GOV_RPM 50 // Target RPM per unit of pump duty
+#define GOV_VOLT 1110 // Nominal battery voltage (xx.xxV)
+#define GOV_KP 8 // Proportional gain (1/1024 per RPM)
+#define GOV_KI 1 // Integral gain (1/1024 per RPM per update)
+#define GOV_LIM 100 // Integral term limit
+#define GOV_TIMEOUT 200000 // Maximum pulse interval (us)
+
+// Tach pulses on B4 are timestamped by the TIM1 counter (1us resolution, 4ms period, see output.c)
+// extended to 32 bits by counting its wraps. Wraps are detected by polling the counter on every
+// pulse, every update and every link monitor tick (3.6ms, see serial.c), so that two polls are
+// never a full period apart. UIF cannot be relied upon for that as no update event is generated
+// while outputs are being committed. No extra interrupt is involved.
+//
+// Speed is derived once per update from the average interval of the pulses received since the
+// previous update. With fewer pulses than updates, the last interval is kept, and the time since
+// the last pulse bounds speed from above as the pump slows down. No pulse for GOV_TIMEOUT means
+// the pump is stopped, i.e. speeds below 60000000/(GOV_TIMEOUT*GOV_PPR) RPM read as 0.
+
+#define PERIOD 4000 // TIM1 period (us)
+
+static int32_t i; // Integral term
+static uint32_t tb, pt, ps, pp;
+static uint16_t tl, rpm;
+static uint8_t pc, pf;
+
+static uint32_t now(void) {
+	uint16_t t = TIM1_CNTRH << 8; // Latch CNTRL
+	t |= TIM1_CNTRL;
+	if (t < tl) tb += PERIOD; // Counter wrapped
+	tl = t;
+	return tb + t;
+}
+
+void initgovernor(void) {
+	EXTI_CR1 = 0x04; // PBIS=01 (rising edge)
+	PB_CR2 = 0x10; // B4 (enable interrupts)
+}
+
+void resetgovernor(void) {
+	i = 0;
+}
+
+int16_t governor(int16_t t, uint16_t v) {
+	uint32_t s, d;
+	uint8_t n;
+	__critical {
+		n = pc;
+		s = ps;
+		d = now() - pt;
+		pc = 0;
+		ps = 0;
+		if (d > GOV_TIMEOUT) pf = 0; // Restart measurement
+	}
+	if (n) pp = s / n;
+	if (!pf) pp = 0;
+	uint32_t r = !pp ? 0 : (60000000 / GOV_PPR) / (d > pp ? d : pp);
+	rpm = r > 0xffff ? 0xffff : r; // Noise pulses may yield absurd values
+	if (!t) { // Pump off
+		resetgovernor();
+		return 0;
+	}
+	int32_t e = (int32_t)t * GOV_RPM - rpm;
+	i += e;
+	if (i > (int32_t)GOV_LIM * 1024 / GOV_KI) i = (int32_t)GOV_LIM * 1024 / GOV_KI;
+	if (i < -(int32_t)GOV_LIM * 1024 / GOV_KI) i = -(int32_t)GOV_LIM * 1024 / GOV_KI;
+	if (v) t = (int32_t)t * GOV_VOLT / v; // Battery compensation
+	return t + ((e * GOV_KP + i * GOV_KI) >> 10);
+}
+
+void pollgovernor(void) {
+	now();
+}
+
+uint16_t pumprpm(void) {
+	return rpm;
+}
+
+void EXTI_PB(void) __interrupt(EXTI_PBIRQ) {
+	uint32_t t = now();
+	if (pf && pc < 250) {
+		ps += t - pt;
+		++pc;
+	}
+	pf = 1;
+	pt = t;
+}
+
+#endif
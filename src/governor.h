@@ -0,0 +1,22 @@
+/*
+** Copyright (C) 2022-2023 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef GOVERNOR
+void EXTI_PB(void) __interrupt(EXTI_PBIRQ);
+#endif
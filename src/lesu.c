@@ -17,6 +17,8 @@
 
 #include "common.h"
 #include "serial.h"
+#include "governor.h"
+#include "light.h"
 
 #define VALVE_MIN 80 // Still closed
 #define VALVE_MUL 50 // Input multiplier (%)
@@ -47,9 +49,23 @@ static uint8_t input3(uint16_t t) {
 	return 1;
 }
 
+#ifdef GOVERNOR
+static uint16_t vbat;
+#endif
+
 static uint16_t output1(int16_t t, uint8_t *s) {
-	if (!(*s = !!t)) return 1500;
-	if ((t += PUMP_MIN) > PUMP_MAX) return 1500 + PUMP_MAX;
+	if (!(*s = !!t)) {
+#ifdef GOVERNOR
+		governor(0, vbat); // Reset governor
+#endif
+		return 1500;
+	}
+	t += PUMP_MIN;
+#ifdef GOVERNOR
+	t = governor(t, vbat);
+	if (t < PUMP_MIN) return 1500 + PUMP_MIN;
+#endif
+	if (t > PUMP_MAX) return 1500 + PUMP_MAX;
 	return 1500 + t;
 }
 
@@ -78,27 +94,34 @@ static uint16_t u1, u2, u3;
 static int16_t i1, i2, i3, i4, i5;
 static uint8_t s1, s2;
 
+static void commit(void) {
+	beginoutput();
+	output(0, u1);
+	output(1, u2);
+	output(2, u3);
+	endoutput();
+}
+
 void update(void) {
-	s1 = input3(chv[5]);
-	s2 = input3(chv[6]);
+#ifdef GOVERNOR
+	uint32_t v;
+	if (sensorsample(1, &v)) vbat = v; // Battery voltage from previous frame
+#endif
 
-	i1 = input1(chv[0]);
-	i2 = input1(chv[1]);
-	i3 = input2(chv[2]);
-	i4 = input2(chv[3]);
-	i5 = input1(chv[4]);
+	s1 = input3(CHV(5));
+	s2 = input3(CHV(6));
+
+	i1 = input1(CHV(0));
+	i2 = input1(CHV(1));
+	i3 = input2(CHV(2));
+	i4 = input2(CHV(3));
+	i5 = input1(CHV(4));
 
 	uint8_t sl;
 	u1 = ramp(output2(i3 + i4), u1, DRIVE_LIM);
 	u2 = ramp(output2(i3 - i4), u2, DRIVE_LIM);
 	u3 = ramp(output1(i1 + i2 + i5, &sl), u3, PUMP_LIM);
-
-	TIM1_CCR1H = u1 >> 8;
-	TIM1_CCR1L = u1;
-	TIM1_CCR2H = u2 >> 8;
-	TIM1_CCR2L = u2;
-	TIM1_CCR3H = u3 >> 8;
-	TIM1_CCR3L = u3;
+	commit();
 
 	static uint8_t bm;
 	uint8_t b = bm;
@@ -108,23 +131,8 @@ void update(void) {
 		if (i4 < -250) b = 1; // Left turn
 		else if (i4 > 250) b = 2; // Right turn
 	}
-	if (b != bm) {
-		TIM2_CR1 = 0x00; // Change OC mode atomically
-		TIM2_CCMR1 = 0x40; // OC1M=100 (reset OC1REF)
-		TIM2_CCMR3 = 0x40; // OC3M=100 (reset OC3REF)
-		if (b & 1) TIM2_CCMR1 = 0x30; // OC1M=011 (toggle OC1REF)
-		if (b & 2) TIM2_CCMR3 = 0x30; // OC3M=011 (toggle OC3REF)
-		if (b & 4) { // Strobe
-			TIM2_PSCR = 0x04; // 500kHz
-			TIM2_IER = 0x01; // UIE=1 (enable interrupts)
-		} else {
-			TIM2_PSCR = 0x07; // 62.5kHz
-			TIM2_IER = 0x00; // Disable interrupts
-		}
-		TIM2_EGR = 0x01; // UG=1 (force update)
-		TIM2_CR1 = 0x01; // CEN=1 (enable counter)
-		bm = b;
-	}
+	light(b);
+	bm = b;
 
 	PD_ODR = i3 < -50 ? 0x00 : 0x10; // D4
 	PC_ODR = s1 ? 0x10 : 0x00; // C4
@@ -139,6 +147,35 @@ void update(void) {
 #endif
 }
 
+void failsafe(void) {
+	i1 = i2 = i3 = i4 = i5 = 0;
+	u1 = ramp(1500, u1, DRIVE_LIM); // Stop tracks as on stick release
+	u2 = ramp(1500, u2, DRIVE_LIM);
+	u3 = 1500; // Stop pump immediately
+	commit();
+#ifdef GOVERNOR
+	resetgovernor(); // Restart PI once the link is restored
+#endif
+
+	light(5); // Beacon
+
+	static uint8_t n;
+	PB_ODR = ++n & 0x40 ? 0x00 : 0x20; // B5 (blink at 2Hz)
+
+	WWDG_CR = 0xff; // Reset watchdog
+}
+
+#if RELAY == 2
+uint16_t relay(uint8_t i) { // Mixed values for downstream boards
+	switch (i) {
+		case 0: return u1;
+		case 1: return u2;
+		case 2: return u3;
+	}
+	return 1500;
+}
+#endif
+
 uint32_t sensor(uint8_t i, uint16_t v) {
 	switch (i) {
 		case 0: // TMP36 sensor
@@ -149,19 +186,6 @@ uint32_t sensor(uint8_t i, uint16_t v) {
 	return 0;
 }
 
-void TIM2_UIF(void) __interrupt(TIM2_UIRQ) {
-	TIM2_SR1 = 0x00; // Clear interrupts
-	static uint8_t n;
-	if (++n & 7) return;
-	if (n & 0x20) {
-		TIM2_CCMR1 = n & 0x08 ? 0x30 : 0x40;
-		TIM2_CCMR3 = n & 0x10 ? 0x30 : 0x40;
-	} else {
-		TIM2_CCMR1 = n & 0x10 ? 0x30 : 0x40;
-		TIM2_CCMR3 = n & 0x08 ? 0x30 : 0x40;
-	}
-}
-
 void main(void) {
 	CLK_CKDIVR = 0x08; // HSI/2=8Mhz clock
 	CLK_HSITRIMR = 0x01;
@@ -176,29 +200,11 @@ void main(void) {
 	PC_CR1 = 0xff;
 	PD_CR1 = 0xf3; // D2,D3 floating
 
-	TIM1_PSCRH = 0x00;
-	TIM1_PSCRL = 0x07; // 1Mhz
-	TIM1_ARRH = 0x0f;
-	TIM1_ARRL = 0x9f; // 250Hz
-	TIM1_EGR = 0x01; // UG=1 (force update)
-	TIM1_CR1 = 0x01; // CEN=1 (enable counter)
-	TIM1_BKR = 0x80; // MOE=1 (enable main output)
-	TIM1_CCMR1 = 0x68; // CC1S=00, OC1PE=1, OC1M=110 (CC1 as output, buffered CCR1, PWM mode 1)
-	TIM1_CCMR2 = 0x68; // CC2S=00, OC2PE=1, OC2M=110 (CC2 as output, buffered CCR2, PWM mode 1)
-	TIM1_CCMR3 = 0x68; // CC3S=00, OC3PE=1, OC3M=110 (CC3 as output, buffered CCR3, PWM mode 1)
-	TIM1_CCER1 = 0x11; // CC1E=1, CC2E=1 (enable OC1, OC2)
-	TIM1_CCER2 = 0x01; // CC3E=1 (enable OC3)
-
-	TIM2_PSCR = 0x07; // 62.5kHz
-	TIM2_ARRH = 0x51;
-	TIM2_ARRL = 0x60; // 3Hz
-	TIM2_EGR = 0x01; // UG=1 (force update)
-	TIM2_CR1 = 0x01; // CEN=1 (enable counter)
-	TIM2_CCMR1 = 0x40; // CC1S=00, OC1M=100 (CC1 as output, force low)
-	TIM2_CCMR3 = 0x40; // CC3S=00, OC3M=100 (CC3 as output, force low)
-	TIM2_CCER1 = 0x03; // CC1E=1, CC1P=1 (enable OC1, active low)
-	TIM2_CCER2 = 0x03; // CC3E=1, CC3P=1 (enable OC3, active low)
-
+	initoutput(0x07); // C6, C7, C3
+	initlight();
+#ifdef GOVERNOR
+	initgovernor();
+#endif
 	initsensor();
 	initserial();
 #ifdef DEBUG
@@ -215,6 +221,9 @@ void main(void) {
 		ENABLE_INTERRUPTS();
 		printf("%4u %4u %4u    %4d %4d %4d %4d %4d    %d %d\n",
 			_u1, _u2, _u3, _i1, _i2, _i3, _i4, _i5, s1, s2);
+#ifdef TRACE
+		printtrace();
+#endif
 #endif
 	}
 }
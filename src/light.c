@@ -0,0 +1,96 @@
+/*
+** Copyright (C) 2022-2023 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "light.h"
+
+// Light patterns are played by TIM2 on OC1/OC3 (active low) in PWM mode 1.
+// Each step is a single timer period of 'len' ticks (4.096ms each) with an OCx output
+// being on for the first 'onx' ticks. Step values are preloaded and take effect atomically
+// at the next update event, so the CPU is interrupted only at step boundaries and not at all
+// if a pattern consists of a single step.
+
+#define STEP(len, on1, on3) {(len) - 1, on1, on3}
+
+static const uint8_t steps[][3] = {
+	STEP(244, 0, 0), // Off
+	STEP(163, 81, 0), // Left turn (1.5Hz)
+	STEP(163, 0, 81), // Right turn (1.5Hz)
+	STEP(163, 81, 81), // Hazard (1.5Hz)
+	STEP(24, 8, 0), // Strobe (double flash, alternating)
+	STEP(159, 8, 0),
+	STEP(24, 0, 8),
+	STEP(159, 0, 8),
+	STEP(244, 12, 12), // Beacon (1Hz)
+};
+
+static const uint8_t patterns[][2] = { // First step, number of steps
+	{0, 1}, // 0 - Off
+	{1, 1}, // 1 - Left turn
+	{2, 1}, // 2 - Right turn
+	{3, 1}, // 3 - Hazard
+	{4, 4}, // 4 - Strobe
+	{8, 1}, // 5 - Beacon
+};
+
+static uint8_t pm, sp, sq, sr;
+
+static void load(void) {
+	const uint8_t *s = steps[sp];
+	TIM2_ARRL = s[0];
+	TIM2_CCR1L = s[1];
+	TIM2_CCR3L = s[2];
+	if (++sp == sq) sp = sr;
+}
+
+static void start(uint8_t i) {
+	const uint8_t *p = patterns[i];
+	TIM2_IER = 0x00; // Disable interrupts
+	TIM2_CR1 = 0x80; // ARPE=1 (stop counter)
+	sp = sr = p[0];
+	sq = p[0] + p[1];
+	load();
+	TIM2_EGR = 0x01; // UG=1 (force update)
+	TIM2_SR1 = 0x00; // Clear UEV after UG
+	if (p[1] > 1) {
+		load(); // Preload next step
+		TIM2_IER = 0x01; // UIE=1 (enable interrupts)
+	}
+	TIM2_CR1 = 0x81; // ARPE=1, CEN=1 (buffered ARR, enable counter)
+	pm = i;
+}
+
+void initlight(void) {
+	TIM2_PSCR = 0x0f; // 244Hz
+	TIM2_ARRH = 0x00;
+	TIM2_CCR1H = 0x00;
+	TIM2_CCR3H = 0x00;
+	TIM2_CCMR1 = 0x68; // CC1S=00, OC1PE=1, OC1M=110 (CC1 as output, buffered CCR1, PWM mode 1)
+	TIM2_CCMR3 = 0x68; // CC3S=00, OC3PE=1, OC3M=110 (CC3 as output, buffered CCR3, PWM mode 1)
+	TIM2_CCER1 = 0x03; // CC1E=1, CC1P=1 (enable OC1, active low)
+	TIM2_CCER2 = 0x03; // CC3E=1, CC3P=1 (enable OC3, active low)
+	start(0);
+}
+
+void light(uint8_t i) {
+	if (i != pm) start(i);
+}
+
+void TIM2_UIF(void) __interrupt(TIM2_UIRQ) {
+	TIM2_SR1 = 0x00; // Clear interrupts
+	load();
+}
@@ -0,0 +1,90 @@
+/*
+** Copyright (C) 2022-2023 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+// Up to 7 servo outputs at 250Hz:
+// 0-3 - TIM1 CH1-4 (C6, C7, C3, C4)
+// 4-6 - TIM2 CH1-3 (C5, D3, A3)
+// Both timers are clocked at 1MHz with the same period and started back-to-back, so their
+// update events coincide. Outputs written between beginoutput() and endoutput() are loaded
+// by the same update event. To that end, updates are re-enabled on both timers at once and not
+// within a few microseconds of the wrap. TIM2 is left alone if none of outputs 4-6 are enabled.
+
+#define PERIOD 4000 // TIM1 period (us)
+
+static volatile uint8_t *const ccr[] = {
+	&TIM1_CCR1H, &TIM1_CCR2H, &TIM1_CCR3H, &TIM1_CCR4H,
+	&TIM2_CCR1H, &TIM2_CCR2H, &TIM2_CCR3H,
+};
+
+static uint8_t om;
+
+void initoutput(uint8_t m) {
+	TIM1_PSCRH = 0x00;
+	TIM1_PSCRL = 0x07; // 1Mhz
+	TIM1_ARRH = 0x0f;
+	TIM1_ARRL = 0x9f; // 250Hz
+	TIM1_EGR = 0x01; // UG=1 (force update)
+	TIM1_BKR = 0x80; // MOE=1 (enable main output)
+	TIM1_CCMR1 = 0x68; // CC1S=00, OC1PE=1, OC1M=110 (CC1 as output, buffered CCR1, PWM mode 1)
+	TIM1_CCMR2 = 0x68; // CC2S=00, OC2PE=1, OC2M=110 (CC2 as output, buffered CCR2, PWM mode 1)
+	TIM1_CCMR3 = 0x68; // CC3S=00, OC3PE=1, OC3M=110 (CC3 as output, buffered CCR3, PWM mode 1)
+	TIM1_CCMR4 = 0x68; // CC4S=00, OC4PE=1, OC4M=110 (CC4 as output, buffered CCR4, PWM mode 1)
+	TIM1_CCER1 = (m & 0x01) | (m << 3 & 0x10); // CC1E, CC2E
+	TIM1_CCER2 = (m >> 2 & 0x01) | (m << 1 & 0x10); // CC3E, CC4E
+	if (m & 0x70) {
+		TIM2_PSCR = 0x03; // 1Mhz
+		TIM2_ARRH = 0x0f;
+		TIM2_ARRL = 0x9f; // 250Hz
+		TIM2_EGR = 0x01; // UG=1 (force update)
+		TIM2_CCMR1 = 0x68; // CC1S=00, OC1PE=1, OC1M=110 (CC1 as output, buffered CCR1, PWM mode 1)
+		TIM2_CCMR2 = 0x68; // CC2S=00, OC2PE=1, OC2M=110 (CC2 as output, buffered CCR2, PWM mode 1)
+		TIM2_CCMR3 = 0x68; // CC3S=00, OC3PE=1, OC3M=110 (CC3 as output, buffered CCR3, PWM mode 1)
+		TIM2_CCER1 = (m >> 4 & 0x01) | (m >> 1 & 0x10); // CC1E, CC2E
+		TIM2_CCER2 = m >> 6 & 0x01; // CC3E
+		TIM2_CR1 = 0x01; // CEN=1 (enable counter)
+	}
+	TIM1_CR1 = 0x01; // CEN=1 (enable counter)
+	om = m;
+}
+
+void beginoutput(void) {
+	TIM1_CR1 |= 0x02; // UDIS=1 (disable update)
+	if (om & 0x70) TIM2_CR1 |= 0x02;
+}
+
+void endoutput(void) {
+	__critical {
+		if (om & 0x70) {
+			uint16_t t;
+			do { // Stay clear of the wrap (TIM2 leads TIM1 by a few cycles)
+				t = TIM1_CNTRH << 8; // Latch CNTRL
+				t |= TIM1_CNTRL;
+			} while (t >= PERIOD - 4);
+		}
+		TIM1_CR1 &= ~0x02; // UDIS=0 (enable update)
+		if (om & 0x70) TIM2_CR1 &= ~0x02;
+	}
+	trace(3);
+}
+
+void output(uint8_t i, uint16_t x) {
+	volatile uint8_t *p = ccr[i];
+	p[0] = x >> 8;
+	p[1] = x;
+}
@@ -23,15 +23,46 @@ void initsensor(void) {
 	ADC_CR2 = 0x08; // ALIGN=1 (right alignment)
 }
 
+static const uint8_t chnums[] = {3, 4};
+
+static const uint16_t types[] = {
+	0x201, // Temperature
+	0x203, // Voltage
+#ifdef GOVERNOR
+	0x207, // Pump RPM
+#endif
+#ifdef TRACE
+	0x202, // Average FRAME latency (us)
+	0x202, // Average DISPATCH latency (us)
+	0x202, // Average UPDATE latency (us)
+	0x202, // Average LOAD latency (us)
+	0x202, // Minimum TOTAL latency (us)
+	0x202, // Average TOTAL latency (us)
+	0x202, // Maximum TOTAL latency (us)
+	0x202, // Maximum FAILSAFE latency (us)
+#endif
+};
+
 uint16_t sensortype(uint8_t i) {
-	if (i > 1) return 0;
-	static const uint16_t types[] = {0x201, 0x203};
+	if (i >= sizeof types / sizeof types[0]) return 0;
 	return types[i];
 }
 
 uint8_t sensordata(uint8_t i, uint32_t *v) {
-	if (i > 1) return 0;
-	static const uint8_t chnums[] = {3, 4};
+	if (i >= sizeof types / sizeof types[0]) return 0;
+	if (i > 1) {
+		i -= 2;
+#ifdef GOVERNOR
+		if (!i--) {
+			*v = pumprpm();
+			return 1;
+		}
+#endif
+#ifdef TRACE
+		*v = tracedata(i);
+#endif
+		return 1;
+	}
 	static uint16_t b[2][64];
 	static uint8_t p[2], q[2];
 	uint8_t ch = chnums[i];
@@ -49,3 +80,14 @@ uint8_t sensordata(uint8_t i, uint32_t *v) {
 	*v = sensor(i, s / n);
 	return 1;
 }
+
+uint8_t sensorsample(uint8_t i, uint32_t *v) { // Single conversion per call (non-blocking)
+	uint8_t ch = chnums[i], r = 0;
+	if (ADC_CSR == (0x80 | ch)) { // EOC=1, CH=ch (previous conversion complete)
+		*v = sensor(i, ADC_DR);
+		r = 1;
+	}
+	ADC_CSR = ch; // EOC=0, CH=ch
+	ADC_CR1 = 0x01; // ADON=1 (start conversion)
+	return r;
+}
@@ -18,7 +18,11 @@
 #include "common.h"
 #include "serial.h"
 
-uint16_t chv[14];
+#if defined DEBUG && defined RELAY
+#error DEBUG and RELAY cannot be used together
+#endif
+
+uint16_t chv[CHCNT((uint32_t)(CHMASK))];
 
 void initserial(void) {
 	UART_BRR2 = 0x05;
@@ -31,6 +35,7 @@ void initserial(void) {
 	TIM4_EGR = 0x01; // UG=1 (force update)
 	TIM4_SR = 0x00; // Clear UEV after UG
 	TIM4_IER = 0x01; // UIE=1 (enable interrupts)
+	TIM4_CR1 = 0x05; // CEN=1, URS=1 (start link monitor, interrupt on overflow only)
 }
 
 int putchar(int c) { // STDOUT -> UART_TX (blocking)
@@ -39,6 +44,26 @@ int putchar(int c) { // STDOUT -> UART_TX (blocking)
 	return 0;
 }
 
+// iBUS servo frame carries 14 channels in the lower 12 bits of each slot. Channels 15-18
+// are spread over the upper 4 bits of slots 1-3, 4-6, 7-9 and 10-12 respectively.
+// Only channels in CHMASK are stored.
+
+#define CH(i) chv[CHIDX(i)] // Unchecked CHV(i) for dead branches
+
+#define SLOT(i) \
+	case i: \
+		if (CHBIT(i)) CH(i) = v & 0x0fff; \
+		break;
+
+#define SLOTX(i) \
+	case i: \
+		if (CHBIT(i)) CH(i) = v & 0x0fff; \
+		if (CHBIT(14 + i / 3)) { \
+			if (i % 3) CH(14 + i / 3) |= (v >> 12) << (i % 3 * 4); \
+			else CH(14 + i / 3) = v >> 12; \
+		} \
+		break;
+
 // Single UART is used both for iBUS servo and telemetry data exchange in the following way:
 // 1) Initially, UART is in full-duplex mode and is listening for servo data on the RX pin.
 // 2) Upon receiving a servo update, UART goes into half-duplex mode and starts listening
@@ -48,8 +73,22 @@ int putchar(int c) { // STDOUT -> UART_TX (blocking)
 // 4) Upon transmitting the last byte, the TX handler waits for the transmission to complete (TC=1)
 //    before turning RX back on.
 // 5) UART reverts back to full-duplex mode after 3.6ms, and the cycle repeats.
+//
+// In RELAY mode, the TX pin carries an iBUS servo stream for downstream boards instead
+// (telemetry is disabled):
+// 1 - Every received byte is retransmitted as is (per-hop delay is one byte time).
+// 2 - A new frame with values provided by relay() is transmitted right after update().
+//
+// TIM4 runs from power-up and keeps running after the half-duplex window as a link monitor.
+// If no valid servo frame arrives within FAILSAFE frame periods (7.7ms each) plus one timer
+// period of margin against jitter, failsafe() is called every 3.6ms until the link is restored
+// (or established after power-up). Detection latency is thus fixed at LOST*3.6ms (28.8ms by
+// default). With TRACE defined, the actual time from the last valid frame to failsafe is
+// measured in TIM4 periods (see trace.c).
 
-static uint8_t tx[8], txp, txq;
+#define LOST ((FAILSAFE * 77 + 35) / 36 + 1) // Timer periods before failsafe
+
+static uint8_t tx[8], txp, txq, lost;
 
 static void send2(uint8_t p, uint16_t x) {
 	uint8_t a = x, b = x >> 8;
@@ -80,6 +119,23 @@ static void send4(uint8_t p, uint32_t x) {
 }
 
 void UART_TXE(void) __interrupt(UART_TXIRQ) {
+#if RELAY == 2
+	static uint8_t p;
+	static uint16_t u, v;
+	uint8_t x;
+	if (p < 2) x = p ? 0x40 : 0x20; // Header
+	else if (p < 30) { // Servo values
+		if (p & 1) x = v >> 8;
+		else x = v = relay((p - 2) >> 1);
+	} else x = p == 30 ? u : u >> 8; // Checksum
+	if (!p) u = 0xffdf;
+	else if (p < 30) u -= x;
+	UART_DR = x;
+	if (++p != 32) return;
+	trace(5);
+	p = 0;
+	UART_CR2 = 0x2c; // REN=1, TEN=1, RIEN=1
+#else
 	if (UART_CR2 & 0x40) { // TCIEN=1
 		UART_CR2 = 0x2c; // REN=1, TEN=1, RIEN=1
 		return;
@@ -87,6 +143,7 @@ void UART_TXE(void) __interrupt(UART_TXIRQ) {
 	UART_SR, UART_DR = tx[txp++]; // Clear TXE+TC
 	if (txp != txq) return;
 	UART_CR2 = 0x48; // TEN=1, TCIEN=1
+#endif
 }
 
 void UART_RXNE(void) __interrupt(UART_RXIRQ) {
@@ -139,7 +196,11 @@ void UART_RXNE(void) __interrupt(UART_RXIRQ) {
 		c = a;
 		d = b;
 	} else { // iBUS servo
+#if RELAY == 1
+		UART_DR = b;
+#endif
 		if (a == 0x20 && b == 0x40) { // Sync
+			trace(0);
 			n = 0;
 			u = 0xff9f;
 			return;
@@ -148,16 +209,26 @@ void UART_RXNE(void) __interrupt(UART_RXIRQ) {
 		uint16_t v = a | b << 8;
 		if (n == 30) { // End of chunk
 			if (u != v) return; // Sync lost
+			trace(1);
+			lost = 0;
+			TIM4_EGR = 0x01; // UG=1 (restart link monitor)
+			trace(2);
 			update();
-#ifndef DEBUG
+			trace(4);
+#if RELAY == 2
+			UART_CR2 = 0xac; // TIEN=1, REN=1, TEN=1, RIEN=1 (start relay frame)
+#elif !defined DEBUG && !defined RELAY
 			m = 0;
 			u = 0xffff;
 			UART_CR5 = 0x08; // HDSEL=1 (enable half-duplex)
-			TIM4_CR1 = 0x09; // CEN=1, OPM=1 (enable counter, one-pulse mode)
 #endif
 			return;
 		}
-		chv[(n >> 1) - 1] = v & 0x0fff;
+		switch ((n >> 1) - 1) {
+			SLOTX(0) SLOTX(1) SLOTX(2) SLOTX(3) SLOTX(4) SLOTX(5)
+			SLOTX(6) SLOTX(7) SLOTX(8) SLOTX(9) SLOTX(10) SLOTX(11)
+			SLOT(12) SLOT(13)
+		}
 	}
 	u -= a + b;
 }
@@ -165,4 +236,12 @@ void UART_RXNE(void) __interrupt(UART_RXIRQ) {
 void TIM4_UIF(void) __interrupt(TIM4_UIRQ) {
 	TIM4_SR = 0x00; // Clear interrupts
 	UART_CR5 = 0x00; // Disable half-duplex
+#ifdef GOVERNOR
+	pollgovernor();
+#endif
+	if (lost != LOST) {
+		if (++lost != LOST) return;
+		tracelost(lost);
+	}
+	failsafe();
 }
@@ -0,0 +1,113 @@
+/*
+** Copyright (C) 2022-2023 Arseny Vakhrushev <arseny.vakhrushev@me.com>
+**
+** This firmware is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This firmware is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this firmware. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#ifdef TRACE
+
+// Pipeline stages are timestamped by the TIM1 counter (1us resolution, 4ms period, see output.c):
+// 0 - first byte of servo frame
+// 1 - checksum validated
+// 2 - update() started
+// 3 - outputs committed
+// 4 - update() ended
+// 5 - last byte of relay frame queued (RELAY 2 only)
+// The TIM1 update event that loads the new CCR values occurs at the counter's wrap right after
+// stage 3, hence LOAD is computed as PERIOD-ts[3] without a timestamp of its own. Every interval
+// between adjacent stages is shorter than the TIM1 period. Stage 3 is also hit by commits from
+// failsafe() that are ignored outside of a frame. RELAY is the per-hop latency in mixed relay mode,
+// i.e. the time from validating the received frame to the end of the relayed one. The last byte
+// is queued behind the one being shifted out, so it is fully transmitted two byte times later.
+// Telemetry is not available in relay mode, so the figures have to be read with a debugger.
+//
+// FAILSAFE spans several TIM1 periods and is measured by the link monitor instead: it is the number
+// of TIM4 periods elapsed since the monitor was restarted by the last valid frame (or since
+// power-up) plus the partial period in TIM4_CNTR at the time failsafe engages.
+
+#define PERIOD 4000 // TIM1 period (us)
+#define BYTE 87 // iBUS byte time (us) at 115200 baud
+#define TICK 3600 // TIM4 period (us), see serial.c
+
+static uint16_t ts[5], tmin[7] = {0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff}, tmax[7];
+static uint32_t tavg[7]; // tavg = avg*4
+static uint8_t tf; // Frame in progress
+
+static uint16_t diff(uint16_t a, uint16_t b) {
+	uint16_t d = b - a;
+	if (d >= PERIOD) d += PERIOD; // Counter wrapped
+	return d;
+}
+
+static void stat(uint8_t i, uint16_t d) {
+	if (d < tmin[i]) tmin[i] = d;
+	if (d > tmax[i]) tmax[i] = d;
+	tavg[i] += d - (tavg[i] >> 2);
+}
+
+void trace(uint8_t i) {
+	uint16_t t = TIM1_CNTRH << 8; // Latch CNTRL
+	t |= TIM1_CNTRL;
+	if (!i) { // Sync is detected upon receiving second byte
+		t -= BYTE;
+		if (t >= PERIOD) t += PERIOD;
+		tf = 1;
+	} else if (i == 5) { // Relay frame sent
+		t += 2 * BYTE;
+		if (t >= PERIOD) t -= PERIOD;
+		stat(6, diff(ts[1], t));
+		return;
+	} else if (!tf) return;
+	ts[i] = t;
+	if (i != 4) return;
+	tf = 0;
+	uint16_t d0 = diff(ts[0], ts[1]);
+	uint16_t d1 = diff(ts[1], ts[2]);
+	uint16_t d3 = PERIOD - ts[3];
+	stat(0, d0);
+	stat(1, d1);
+	stat(2, diff(ts[2], ts[4]));
+	stat(3, d3);
+	stat(4, d0 + d1 + diff(ts[2], ts[3]) + d3);
+}
+
+void tracelost(uint8_t n) { // Failsafe engaged after n TIM4 periods
+	stat(5, (uint16_t)n * TICK + TIM4_CNTR * 16); // 62.5kHz
+}
+
+uint16_t tracedata(uint8_t i) { // 0-3 - average FRAME..LOAD, 4-6 - minimum/average/maximum TOTAL, 7 - maximum FAILSAFE
+	switch (i) {
+		case 4: return tmin[4] == 0xffff ? 0 : tmin[4];
+		case 5: return tavg[4] >> 2;
+		case 6: return tmax[4];
+		case 7: return tmax[5];
+	}
+	return tavg[i] >> 2;
+}
+
+#ifdef DEBUG
+void printtrace(void) {
+	static const char *const names[] = {"FRAME   ", "DISPATCH", "UPDATE  ", "LOAD    ", "TOTAL   ", "FAILSAFE"};
+	for (uint8_t i = 0; i < 6; ++i) {
+		DISABLE_INTERRUPTS();
+		uint16_t _min = tmin[i], _max = tmax[i], _avg = tavg[i] >> 2;
+		ENABLE_INTERRUPTS();
+		printf("%s %4u %4u %4u\n", names[i], _min, _avg, _max);
+	}
+}
+#endif
+
+#endif
@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "serial.h"
+#include "governor.h"
 
 #define CH1_TRIM -50 // Bucket
 #define CH2_TRIM 50 // Boom
@@ -30,6 +31,12 @@
 #define PUMP_MAX 340 // Maximum duty
 #define PUMP_LIM 20 // Acceleration limit
 
+#ifdef TRACKS
+#define DRIVE_MIN 50 // Minimum duty
+#define DRIVE_MAX 500 // Maximum duty
+#define DRIVE_LIM 20 // Acceleration limit
+#endif
+
 #define VOLT1 3329 // mV
 #define VOLT2 3662 // xx.xxV = VOLT1*(R1+R2)/R2
 
@@ -47,12 +54,41 @@ static uint8_t input2(uint16_t t) {
 	return 1;
 }
 
+#ifdef TRACKS
+static int16_t input3(uint16_t t) {
+	return t - 1500;
+}
+#endif
+
+#ifdef GOVERNOR
+static uint16_t vbat;
+#endif
+
 static uint16_t output1(int16_t t, uint8_t *s) {
-	if (!(*s = !!t)) return 1500;
-	if ((t += PUMP_MIN) > PUMP_MAX) return 1500 + PUMP_MAX;
+	if (!(*s = !!t)) {
+#ifdef GOVERNOR
+		governor(0, vbat); // Reset governor
+#endif
+		return 1500;
+	}
+	t += PUMP_MIN;
+#ifdef GOVERNOR
+	t = governor(t, vbat);
+	if (t < PUMP_MIN) return 1500 + PUMP_MIN;
+#endif
+	if (t > PUMP_MAX) return 1500 + PUMP_MAX;
 	return 1500 + t;
 }
 
+#ifdef TRACKS
+static uint16_t output2(int16_t t) {
+	if (t > -DRIVE_MIN && t < DRIVE_MIN) return 1500;
+	if (t < -DRIVE_MAX) return 1500 - DRIVE_MAX;
+	if (t > DRIVE_MAX) return 1500 + DRIVE_MAX;
+	return 1500 + t;
+}
+#endif
+
 static uint16_t ramp(uint16_t t, uint16_t u, uint16_t x) {
 	if (!u || !x) return t;
 	if (t < 1500) {
@@ -67,30 +103,57 @@ static uint16_t ramp(uint16_t t, uint16_t u, uint16_t x) {
 	return t;
 }
 
+#ifdef TRACKS
+static uint16_t u5, u6;
+static int16_t i4, i5;
+#endif
+
 static uint16_t u1, u2, u3, u4;
 static int16_t i1, i2, i3;
 static uint8_t s1;
 
+static void commit(void) {
+	beginoutput();
+	output(0, u1);
+	output(1, u2);
+	output(2, u3);
+	output(3, u4);
+#ifdef TRACKS
+	output(4, u5);
+	output(6, u6);
+#endif
+	endoutput();
+}
+
 void update(void) {
-	s1 = input2(chv[6]);
+#ifdef GOVERNOR
+	uint32_t v;
+	if (sensorsample(1, &v)) vbat = v; // Battery voltage from previous frame
+#endif
 
-	i1 = input1(chv[0], &u1, CH1_TRIM);
-	i2 = input1(chv[1], &u2, CH2_TRIM);
-	i3 = input1(chv[2], &u3, CH3_TRIM);
+	s1 = input2(CHV(6));
+
+	i1 = input1(CHV(0), &u1, CH1_TRIM);
+	i2 = input1(CHV(1), &u2, CH2_TRIM);
+	i3 = input1(CHV(2), &u3, CH3_TRIM);
+#ifdef TRACKS
+	i4 = input3(CHV(4));
+	i5 = input3(CHV(5));
+#endif
 
 	uint8_t sl;
 	u4 = ramp(output1(i1 + i2 + i3, &sl), u4, PUMP_LIM);
+#ifdef TRACKS
+	u5 = ramp(output2(i4), u5, DRIVE_LIM);
+	u6 = ramp(output2(i5), u6, DRIVE_LIM);
+#endif
+	commit();
 
-	TIM1_CCR1H = u1 >> 8;
-	TIM1_CCR1L = u1;
-	TIM1_CCR2H = u2 >> 8;
-	TIM1_CCR2L = u2;
-	TIM1_CCR3H = u3 >> 8;
-	TIM1_CCR3L = u3;
-	TIM1_CCR4H = u4 >> 8;
-	TIM1_CCR4L = u4;
-
+#ifdef TRACKS
+	PD_ODR = s1 ? 0x10 : 0x00; // D4
+#else
 	PC_ODR = s1 ? 0x20 : 0x00; // C5
+#endif
 	PB_ODR = sl ? 0x00 : 0x20; // B5
 
 	WWDG_CR = 0xff; // Reset watchdog
@@ -102,6 +165,44 @@ void update(void) {
 #endif
 }
 
+void failsafe(void) {
+	i1 = i2 = i3 = 0;
+	u1 = 1500 + CH1_TRIM; // Close valves
+	u2 = 1500 + CH2_TRIM;
+	u3 = 1500 + CH3_TRIM;
+	u4 = 1500; // Stop pump immediately
+#ifdef TRACKS
+	i4 = i5 = 0;
+	u5 = ramp(1500, u5, DRIVE_LIM); // Stop tracks as on stick release
+	u6 = ramp(1500, u6, DRIVE_LIM);
+#endif
+	commit();
+#ifdef GOVERNOR
+	resetgovernor(); // Restart PI once the link is restored
+#endif
+
+	static uint8_t n;
+	PB_ODR = ++n & 0x40 ? 0x00 : 0x20; // B5 (blink at 2Hz)
+
+	WWDG_CR = 0xff; // Reset watchdog
+}
+
+#if RELAY == 2
+uint16_t relay(uint8_t i) { // Mixed values for downstream boards
+	switch (i) {
+		case 0: return u1;
+		case 1: return u2;
+		case 2: return u3;
+		case 3: return u4;
+#ifdef TRACKS
+		case 4: return u5;
+		case 5: return u6;
+#endif
+	}
+	return 1500;
+}
+#endif
+
 uint32_t sensor(uint8_t i, uint16_t v) {
 	switch (i) {
 		case 0: // TMP36 sensor
@@ -118,31 +219,34 @@ void main(void) {
 
 	PB_ODR = 0x20;
 	PB_DDR = 0x20; // B5 (active low)
+#ifdef TRACKS
+	PD_DDR = 0x10; // D4
+#else
 	PC_DDR = 0x20; // C5
+#endif
 	PA_CR1 = 0xff;
 	PB_CR1 = 0xff;
 	PC_CR1 = 0xff;
 	PD_CR1 = 0xf3; // D2,D3 floating
 
-	TIM1_PSCRH = 0x00;
-	TIM1_PSCRL = 0x07; // 1Mhz
-	TIM1_ARRH = 0x0f;
-	TIM1_ARRL = 0x9f; // 250Hz
-	TIM1_EGR = 0x01; // UG=1 (force update)
-	TIM1_CR1 = 0x01; // CEN=1 (enable counter)
-	TIM1_BKR = 0x80; // MOE=1 (enable main output)
-	TIM1_CCMR1 = 0x68; // CC1S=00, OC1PE=1, OC1M=110 (CC1 as output, buffered CCR1, PWM mode 1)
-	TIM1_CCMR2 = 0x68; // CC2S=00, OC2PE=1, OC2M=110 (CC2 as output, buffered CCR2, PWM mode 1)
-	TIM1_CCMR3 = 0x68; // CC3S=00, OC3PE=1, OC3M=110 (CC3 as output, buffered CCR3, PWM mode 1)
-	TIM1_CCMR4 = 0x68; // CC4S=00, OC4PE=1, OC4M=110 (CC4 as output, buffered CCR4, PWM mode 1)
-	TIM1_CCER1 = 0x11; // CC1E=1, CC2E=1 (enable OC1, OC2)
-	TIM1_CCER2 = 0x11; // CC3E=1, CC4E=1 (enable OC3, OC4)
+#ifdef TRACKS
+	initoutput(0x5f); // C6, C7, C3, C4, C5, A3
+#else
+	initoutput(0x0f); // C6, C7, C3, C4
+#endif
 
+#ifdef GOVERNOR
+	initgovernor();
+#endif
 	initsensor();
 	initserial();
 #ifdef DEBUG
 	printf("\n");
+#ifdef TRACKS
+	printf("  U1   U2   U3   U4   U5   U6      I1   I2   I3   I4   I5    SW\n");
+#else
 	printf("  U1   U2   U3   U4      I1   I2   I3    SW\n");
+#endif
 #endif
 	for (;;) {
 		CFG_GCR = 0x02; // AL=1 (suspend main loop)
@@ -151,9 +255,20 @@ void main(void) {
 		DISABLE_INTERRUPTS();
 		uint16_t _u1 = u1, _u2 = u2, _u3 = u3, _u4 = u4;
 		int16_t _i1 = i1, _i2 = i2, _i3 = i3;
+#ifdef TRACKS
+		uint16_t _u5 = u5, _u6 = u6;
+		int16_t _i4 = i4, _i5 = i5;
+		ENABLE_INTERRUPTS();
+		printf("%4u %4u %4u %4u %4u %4u    %4d %4d %4d %4d %4d    %d\n",
+			_u1, _u2, _u3, _u4, _u5, _u6, _i1, _i2, _i3, _i4, _i5, s1);
+#else
 		ENABLE_INTERRUPTS();
 		printf("%4u %4u %4u %4u    %4d %4d %4d    %d\n",
 			_u1, _u2, _u3, _u4, _i1, _i2, _i3, s1);
+#endif
+#ifdef TRACE
+		printtrace();
+#endif
 #endif
 	}
 }